@@ -8,6 +8,7 @@ Date: Nov.23,2014
 #include <iostream>
 #include <vector>
 #include <map>
+#include <set>
 #include <cmath>
 #include <algorithm>
 #include <string>
@@ -15,6 +16,16 @@ Date: Nov.23,2014
 #include <iterator>
 #include <fstream>
 #include <sstream>
+#include <iomanip>
+#include <cstdio>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <errno.h>
 
 //using namespace std;
 using std::cin;
@@ -27,6 +38,164 @@ using std::ifstream;
 using std::ofstream;
 using std::vector;
 using std::map;
+using std::set;
+
+//reference samples exported by clustering() and used in prediction mode
+struct Model
+{
+    int Num;
+    int Dim;
+    int metric;
+    int mode;
+    int nn;
+    int nClus;
+    double radius;
+    vector<vector<double> > data;
+    vector<double> rho;
+    vector<int> clus;
+    vector<int> halo;
+    vector<double> boundary_rho;//density on the boundary for each cluster
+};
+
+//kd-tree over the reference samples, every node owns index[lo,hi)
+struct KDTree
+{
+    int Dim;
+    vector<int> index;
+    vector<int> lo;
+    vector<int> hi;
+    vector<int> left;//-1 for leaves
+    vector<int> right;
+    vector<double> max_rho;//maximum density inside each node
+    vector<double> box;//bounding box of each node: Dim minima followed by Dim maxima
+};
+
+//header of the file caching the distance matrix,
+//followed by the up triangle region of the matrix row by row
+#define DISTANCE_CACHE_MAGIC "CLDPDIST"
+struct DistanceCacheHeader
+{
+    char magic[8];
+    unsigned long long num;
+    unsigned long long metric;
+    unsigned long long elem_size;
+    double max_dist;//largest distance between two samples
+};
+
+//candidate cluster center: gamma=rho*delta and index of the sample
+typedef std::pair<double,int> Candidate;
+//maximum number of candidates when the number of clusters is estimated
+const size_t MAX_CANDIDATES=1000;
+
+//distances from every sample to a few pivot samples,used to bound the
+//distance between two samples with the triangle inequality
+struct PivotTable
+{
+    int nPivots;
+    vector<int> pivots;
+    vector<double> dist;//dist[i*nPivots+p] is the distance from sample i to pivot p
+    double tolerance;//absolute slack of the bounds for the rounding errors
+    bool angular;//the distances are the angles acos(s) of the cosine similarities s
+    vector<int> sorted;//samples sorted by the distance to the first pivot
+    vector<int> rank;//position of each sample in sorted
+    vector<double> key;//distance to the first pivot in the order of sorted
+    vector<double> sorted_dist;//distances to the pivots in the order of sorted
+};
+//number of pivots
+const int NUM_PIVOTS=8;
+//fraction of the pairs whose cost the pruned search of delta may reach before
+//it falls back to the full scan,and the number of samples between two checks
+const double PIVOT_MAX_WORK=0.1;
+const int PIVOT_CHECK=1024;
+//fraction of the pairs within the range of the first pivot above which
+//the halos are filtered by the contiguous scan of all pairs
+const double PIVOT_MAX_RANGE=0.25;
+//slack of the bounds from pivots relative to the largest distance,
+//the rounding errors of |d(i,p)-d(j,p)| scale with the distances to the pivots.
+//For cosine similarity,which lies in [-1,1],it is the error of a similarity
+const double PIVOT_SLACK=1e-9;
+
+//state shared by the workers of prediction mode
+struct PredictContext
+{
+    const Model* model;
+    const vector<vector<double> >* vec;
+    const KDTree* tree;//NULL for cosine metric
+    double(*metricfun)(const vector<double>&,const vector<double>&);
+    size_t k;//number of nearest reference samples in KNN mode
+    int* res;
+    int* halo;
+    int next;//first sample not taken by any worker yet
+};
+
+//distance matrix stored in one contiguous block,
+//which is either allocated or mapped from the cache file
+struct DistanceMatrix
+{
+    int Num;
+    double** rows;
+    double* base;
+    void* mapped;
+    size_t mapped_len;
+    double maxDist;//largest distance between two samples
+    PivotTable pivots;//no pivots for cosine metric
+};
+
+//buffers used by one clustering,reused between requests in server mode
+struct Workspace
+{
+    vector<double> rho;
+    vector<double> delta;
+    vector<int> neighbor;
+    vector<int> order;
+    vector<int> halo;
+    vector<double> boundary_rho;
+};
+
+//clustering request of the server mode
+struct Job
+{
+    long id;
+    int nClus;
+    int detector;
+    int mode;
+    int nn;
+    double tau;
+    string outputfile;
+    bool named;//whether the request gave --output
+    string error;
+};
+
+//slot of the job queue,seq tells whether the slot is free or holds a job
+struct JobSlot
+{
+    size_t seq;//accessed atomically
+    Job job;
+};
+
+//bounded lock-free queue of jobs with one producer and many workers,
+//the semaphore counts the jobs so that idle workers block instead of polling
+struct JobQueue
+{
+    vector<JobSlot> slots;
+    size_t mask;//capacity-1,the capacity is a power of 2
+    size_t head;//accessed atomically
+    size_t tail;//accessed atomically
+    int done;//no more jobs will be pushed,accessed atomically
+    sem_t jobs;
+};
+
+//state shared by the workers of the server mode
+struct ServerContext
+{
+    const vector<vector<double> >* vec;
+    const DistanceMatrix* dm;
+    int metric;
+    JobQueue* queue;
+    std::ostream* reply;
+    pthread_mutex_t* reply_lock;//also guards outputs
+    set<string>* outputs;//output files of the jobs in flight
+};
 
 //calculate the distance between two samples with Euclidean distance
 double EuclideanDistance(const vector<double>& vec1,const vector<double>& vec2);
@@ -36,42 +205,108 @@ double cosineDistance(const vector<double>& vec1,const vector<double>& vec2);
 double getMatrixData(double** matrix,int i,int j);
 //set the value of specific position in the matrix
 void setMatrixData(double** matrix,int i,int j,double val);
-//calculate the two-dimensional distance matrix
-void distanceMatrix(const vector<vector<double> >& vec,double** matrix,
-                    double (*metricfun)(const vector<double>&,const vector<double>&));
+//calculate the two-dimensional distance matrix and return the largest distance
+double distanceMatrix(const vector<vector<double> >& vec,double** matrix,
+                      double (*metricfun)(const vector<double>&,const vector<double>&));
+//number of elements stored for the up triangle region of a Num*Num matrix
+size_t matrixSize(int Num);
+//point the rows of the matrix into one contiguous block
+void matrixRows(double* base,int Num,double** matrix);
+//hash the features of all samples
+unsigned long long hashData(const vector<vector<double> >& vec);
+//name of the cache file for the given samples and metric
+string distanceCacheName(const string& cachedir,const vector<vector<double> >& vec,int metric);
+//save the distance matrix into the cache file
+bool saveDistanceCache(const string& cachefile,const double* base,int Num,int metric,
+                       double maxDist);
+//map the cache file of the distance matrix into memory
+void* mapDistanceCache(const string& cachefile,int Num,int metric,size_t& len);
 //searh for appropriate search radius
 double searchRadius(double** matrix,int Num,double tau=0.02);
 //calculate the density for each sample
 void density(double** matrix,int Num,double threshold,int mode,int nn,double* res);
+//distance between two samples used by the pivots for a value of the distance matrix
+double pivotDistance(double val,bool angular);
+//select pivot samples and store the distances from every sample to them
+void selectPivots(double** matrix,int Num,int nPivots,int metric,double maxDist,
+                  PivotTable& table);
+//lower bound of the distance between two samples with the pivots
+double pivotLowerBound(const double* a,const double* b,int nPivots,double bound);
+//print the pruning rate and time of a stage
+void reportPruning(const char* stage,long long nRead,long long nPivotPruned,
+                   long long nPairs,double elapsed);
 //get the minimum distance delta_i=min(d_ij) where delta_j>delta_i
 void getDelta(double** matrix,int Num,const double* rho,double* delta,
-              int* neighbor,int* order);
+              int* neighbor,int* order,double maxDist,const PivotTable* pivots);
 //sort by density and store the index of corresponding samples
 void sortByDensity(const double* rho,int Num,int* index);
+//whether candidate a ranks higher than candidate b
+bool candidateGreater(const Candidate& a,const Candidate& b);
 //find number of clusters automaticlly with Anomaly Detection
-int numberOfClusters(const double* pgamma,int Num,double threshold);
+int numberOfClusters(const vector<Candidate>& cand,double mu,double std,double threshold);
+//find number of clusters at the largest gap of gamma
+int largestGapClusters(const vector<Candidate>& cand);
+//find number of clusters at the knee of gamma
+int kneeClusters(const vector<Candidate>& cand);
 //compute the cumulative distribution function of normal distribution
 double CDFofNormalDistribution(double x);
 //find initial nClus cluster centers
 int findInitialCenters(const double* rho,const double* delta,int Num,
-                       int nClus,vector<int>& vec);
+                       int nClus,int detector,vector<int>& vec);
 //assigen cluster centers to samples
 void assignClusters(const int* order,const int* neighbor,int Num,
                     const vector<int>& vec,int* res);
 //separate halos from cores of each cluster
 void filterHalos(double** matrix,int Num,int nClus,const int* clus,
-                 const double* rho,double radius,int* halo);
+                 const double* rho,double radius,int* halo,double* boundary_rho,
+                 const PivotTable* pivots);
+//load or calculate the distance matrix
+void loadDistanceMatrix(const vector<vector<double> >& vec,int metric,
+                        const string& cachedir,DistanceMatrix& dm);
+//free the distance matrix
+void freeDistanceMatrix(DistanceMatrix& dm);
+//clustering on a distance matrix with the given buffers
+int clusterMatrix(const vector<vector<double> >& vec,const DistanceMatrix& dm,int nClus,
+                  int detector,int mode,int nn,double tau,int metric,
+                  const string& outputfile,Workspace& ws,int* clus);
 //algorithm of clustering
-void clustering(const vector<vector<double> >& vec,int nClus,int mode,int nn,
-                double tau,int metric,const string& outputfile,int* clus);
+void clustering(const vector<vector<double> >& vec,int nClus,int detector,int mode,
+                int nn,double tau,int metric,const string& outputfile,
+                const string& cachedir,int* clus);
+//save the reference samples and their clustering into a model file
+void saveModel(const vector<vector<double> >& vec,const double* rho,const int* clus,
+               const int* halo,const double* boundary_rho,int nClus,double radius,
+               int metric,int mode,int nn,const string& modelfile);
+//load the model saved by saveModel
+bool loadModel(const char* modelfile,Model& model);
+//build the kd-tree over the reference samples
+void buildKDTree(const vector<vector<double> >& vec,const double* rho,KDTree& tree);
+//assign one new sample to the clusters of the model
+void predictSample(const PredictContext& ctx,int i);
+//worker thread of prediction mode
+void* predictWorker(void* arg);
+//assign new samples to the clusters of an existing model
+void predict(const Model& model,const vector<vector<double> >& vec,int* res,int* halo);
+//parse one line of options into a job of the server mode
+bool parseJob(const string& line,int Num,const Job& defaults,Job& job);
+//append a job to the queue
+void pushJob(JobQueue& queue,const Job& job);
+//take a job from the queue
+bool popJob(JobQueue& queue,Job& job);
+//worker thread of the server mode
+void* serverWorker(void* arg);
+//serve clustering requests read from stdin
+void serve(const vector<vector<double> >& vec,int metric,const string& cachedir,
+           int nWorkers,const Job& defaults,std::ostream& reply);
 //read data from file
 void readData(const char* filename,int withlabel,vector<vector<double> >& data_vec,
               vector<int>& label_vec);
 //check the correctness of function computing CDF of normal distribution
 void checkCDF();
 //process parameters
-void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
-                   int&mode,double& tau,int& metric,int& withlabel,string& outputfile);
+void processParams(const string& line,string& inputfile,int& nClus,int& detector,\
+                   int& nn,int&mode,double& tau,int& metric,int& withlabel,string& outputfile,
+                   string& modelfile,string& cachedir,int& nWorkers);
 //print help information
 void help();
 
@@ -82,17 +317,28 @@ int main(int argc,char* argv[])
     for(int i=1;i<argc;++i)
         para_line+=string(argv[i])+' ';
 
+    //in server mode stdout only carries the replies,
+    //so all the other messages are redirected to stderr
+    std::streambuf* stdoutbuf=cout.rdbuf();
+    for(int i=1;i<argc;++i)
+        if(string(argv[i])=="--serve")
+            cout.rdbuf(cerr.rdbuf());
+
     //parse the following parameters stored in the para_line
     string inputfile;
     int nClus;
+    int detector;
     int nn;
     double tau;
     int metric;
     int mode;
     int withlabel=0;
     string outputfile;
-    processParams(para_line,inputfile,nClus,nn,mode,
-                  tau,metric,withlabel,outputfile);
+    string modelfile;
+    string cachedir;
+    int nWorkers;
+    processParams(para_line,inputfile,nClus,detector,nn,mode,
+                  tau,metric,withlabel,outputfile,modelfile,cachedir,nWorkers);
 
     //read data from inputfile
     vector<vector<double> > data_vec;
@@ -101,10 +347,55 @@ int main(int argc,char* argv[])
 	cout<<"reading data...\n";
     readData(inputfile.c_str(),withlabel,data_vec,label_vec);
 
-    //clustering procedure
     int Num=data_vec.size();
+    if(modelfile!="")//assign the samples to the clusters of an existing model
+    {
+        Model model;
+        cout<<"loading model...\n";
+        if(!loadModel(modelfile.c_str(),model))
+            return 1;
+        for(int i=0;i<Num;++i)
+            if(int(data_vec[i].size())!=model.Dim)
+            {
+                cerr<<"Sample "<<i<<" has "<<data_vec[i].size()<<" features,"
+                    <<"but the model has "<<model.Dim<<endl;
+                return 1;
+            }
+        int* res=new int[Num];
+        int* halo=new int[Num];
+        predict(model,data_vec,res,halo);
+
+        string predict_file=outputfile+".prediction";
+        ofstream pred_out(predict_file.c_str());
+        for(int i=0;i<Num;++i)
+            pred_out<<i<<' '<<*(res+i)<<' '<<*(halo+i)<<endl;
+        pred_out.close();
+
+        delete[] res;
+        delete[] halo;
+        return 0;
+    }
+
+    if(nWorkers>=0)//serve clustering requests on the samples
+    {
+        Job defaults;
+        defaults.id=0;
+        defaults.nClus=nClus;
+        defaults.detector=detector;
+        defaults.mode=mode;
+        defaults.nn=nn;
+        defaults.tau=tau;
+        defaults.outputfile=outputfile;
+        defaults.named=false;
+        std::ostream reply(stdoutbuf);
+        serve(data_vec,metric,cachedir,nWorkers,defaults,reply);
+        cout.rdbuf(stdoutbuf);
+        return 0;
+    }
+
+    //clustering procedure
     int* res=new int[Num];//used to store clustering results
-    clustering(data_vec,nClus,mode,nn,tau,metric,outputfile,res);
+    clustering(data_vec,nClus,detector,mode,nn,tau,metric,outputfile,cachedir,res);
 
     delete[] res;//free memory
 	return 0;
@@ -169,12 +460,13 @@ void setMatrixData(double** matrix,int i,int j,double val)
 	*(*(matrix+row)+col)=val;
 }
 
-//calculate the two-dimensional distance matrix
-void distanceMatrix(const vector<vector<double> >& vec,double** matrix,
-                    double (*metricfun)(const vector<double>&,const vector<double>&))
+//calculate the two-dimensional distance matrix and return the largest
+//distance between two samples,0 on the diagonal is included
+double distanceMatrix(const vector<vector<double> >& vec,double** matrix,
+                      double (*metricfun)(const vector<double>&,const vector<double>&))
 {
 	size_t sz=vec.size();
-	double dist=0.0;
+	double dist=0.0,res=0.0;
 	for(size_t i=0;i<sz;++i)
 	{
 		setMatrixData(matrix,i,i,0);
@@ -182,8 +474,117 @@ void distanceMatrix(const vector<vector<double> >& vec,double** matrix,
 		{
 			dist=metricfun(vec[i],vec[j]);
 			setMatrixData(matrix,i,j,dist);
+			if(dist>res) res=dist;
 		}
 	}
+	return res;
+}
+
+//number of elements stored for the up triangle region of a Num*Num matrix
+size_t matrixSize(int Num)
+{
+	return size_t(Num)*(Num+1)/2;
+}
+
+//point the rows of the matrix into one contiguous block,
+//row i holds the Num-i elements from (i,i) to (i,Num-1)
+void matrixRows(double* base,int Num,double** matrix)
+{
+	size_t offset=0;
+	for(int i=0;i<Num;++i)
+	{
+		*(matrix+i)=base+offset;
+		offset+=Num-i;
+	}
+}
+
+//hash the features of all samples with 64-bit FNV-1a
+unsigned long long hashData(const vector<vector<double> >& vec)
+{
+	unsigned long long hash=14695981039346656037ULL;
+	for(size_t i=0;i<vec.size();++i)
+	{
+		unsigned long long dim=vec[i].size();
+		for(size_t t=0;t<sizeof(dim);++t)
+			hash=(hash^((dim>>(8*t))&0xff))*1099511628211ULL;
+		if(vec[i].empty())
+			continue;//blank line
+		const unsigned char* p=(const unsigned char*)&vec[i][0];
+		size_t len=vec[i].size()*sizeof(double);
+		for(size_t t=0;t<len;++t)
+			hash=(hash^p[t])*1099511628211ULL;
+	}
+	return hash;
+}
+
+//name of the cache file for the given samples and metric
+string distanceCacheName(const string& cachedir,const vector<vector<double> >& vec,int metric)
+{
+	stringstream ss;
+	ss<<cachedir<<'/'<<std::hex<<std::setw(16)<<std::setfill('0')<<hashData(vec)
+	  <<std::dec<<"_n"<<vec.size()<<"_m"<<metric<<".dist";
+	return ss.str();
+}
+
+//save the distance matrix stored in one contiguous block into the cache file
+//it is written into a temporary file first and renamed when complete
+bool saveDistanceCache(const string& cachefile,const double* base,int Num,int metric,
+                       double maxDist)
+{
+	DistanceCacheHeader header;
+	memcpy(header.magic,DISTANCE_CACHE_MAGIC,sizeof(header.magic));
+	header.num=Num;
+	header.metric=metric;
+	header.elem_size=sizeof(double);
+	header.max_dist=maxDist;
+
+	string tmpfile=cachefile+".tmp";
+	FILE* fp=fopen(tmpfile.c_str(),"wb");
+	if(NULL==fp)
+		return false;
+	bool ok=fwrite(&header,sizeof(header),1,fp)==1;
+	const size_t chunk=size_t(1)<<23;//8M elements per write
+	size_t total=matrixSize(Num);
+	for(size_t pos=0;ok&&pos<total;pos+=chunk)
+	{
+		size_t cnt=total-pos<chunk?total-pos:chunk;
+		ok=fwrite(base+pos,sizeof(double),cnt,fp)==cnt;
+	}
+	ok=(fclose(fp)==0)&&ok;
+	if(ok)
+		ok=rename(tmpfile.c_str(),cachefile.c_str())==0;
+	if(!ok)
+		remove(tmpfile.c_str());
+	return ok;
+}
+
+//map the cache file into memory,return the address of the mapping
+//and store its length in len,NULL if the cache is missing or invalid
+void* mapDistanceCache(const string& cachefile,int Num,int metric,size_t& len)
+{
+	int fd=open(cachefile.c_str(),O_RDONLY);
+	if(fd<0)
+		return NULL;
+	struct stat st;
+	len=sizeof(DistanceCacheHeader)+matrixSize(Num)*sizeof(double);
+	if(fstat(fd,&st)!=0||size_t(st.st_size)!=len)
+	{
+		close(fd);
+		return NULL;
+	}
+	void* addr=mmap(NULL,len,PROT_READ,MAP_SHARED,fd,0);
+	close(fd);
+	if(MAP_FAILED==addr)
+		return NULL;
+	const DistanceCacheHeader* header=(const DistanceCacheHeader*)addr;
+	if(memcmp(header->magic,DISTANCE_CACHE_MAGIC,sizeof(header->magic))!=0||
+	   header->num!=(unsigned long long)Num||header->metric!=(unsigned long long)metric||
+	   header->elem_size!=sizeof(double))
+	{
+		munmap(addr,len);
+		return NULL;
+	}
+	return addr;
 }
 
 //searh for appropriate search radius
@@ -323,72 +724,325 @@ double CDFofNormalDistribution(double x)
 	return res;
 }
 
+//distance between two samples used by the pivots for a value of the distance matrix.
+//cosineDistance() is a similarity s which breaks the triangle inequality,
+//so it is turned into the angle acos(s) between the samples which satisfies it
+double pivotDistance(double val,bool angular)
+{
+    if(!angular)
+        return val;
+    if(val>1.0) val=1.0;
+    else if(val<-1.0) val=-1.0;
+    return acos(val);
+}
+
+//select pivot samples by farthest-first traversal and store the
+//distances from every sample to them,the first pivot is the sample
+//farthest from sample 0.The samples are also sorted by the distance to the
+//first pivot,so that the samples within a range of it are contiguous.
+//The slack of the bounds is derived from maxDist,the largest distance between two samples,
+//for Euclidean distance.For cosine similarity it covers the angles,where a rounding
+//error e of a similarity moves its angle by up to sqrt(2*e)
+void selectPivots(double** matrix,int Num,int nPivots,int metric,double maxDist,
+                  PivotTable& table)
+{
+    if(nPivots>Num) nPivots=Num;
+    table.nPivots=nPivots;
+    table.angular=metric==1;
+    if(table.angular)
+        table.tolerance=3*sqrt(2*PIVOT_SLACK);
+    else
+        table.tolerance=PIVOT_SLACK*maxDist;
+    table.pivots.clear();
+    table.dist.assign(size_t(Num)*nPivots,0.0);
+    table.sorted.clear();
+    table.rank.clear();
+    table.key.clear();
+    table.sorted_dist.clear();
+    if(nPivots<=0)
+        return;
+    //minimum distance from each sample to the selected pivots,
+    //the diagonal of the matrix is 0 for both metrics and is not read
+    vector<double> nearest(Num);
+    for(int i=0;i<Num;++i)
+        nearest[i]=i==0?0.0:pivotDistance(getMatrixData(matrix,0,i),table.angular);
+    for(int p=0;p<nPivots;++p)
+    {
+        int pivot=std::max_element(nearest.begin(),nearest.end())-nearest.begin();
+        table.pivots.push_back(pivot);
+        for(int i=0;i<Num;++i)
+        {
+            double dist=i==pivot?0.0:pivotDistance(getMatrixData(matrix,pivot,i),table.angular);
+            table.dist[size_t(i)*nPivots+p]=dist;
+            if(p==0||dist<nearest[i]) nearest[i]=dist;
+        }
+    }
+
+    vector<std::pair<double,int> > buf(Num);
+    for(int i=0;i<Num;++i)
+        buf[i]=std::make_pair(table.dist[size_t(i)*nPivots],i);
+    std::sort(buf.begin(),buf.end());
+    table.sorted.resize(Num);
+    table.rank.resize(Num);
+    table.key.resize(Num);
+    table.sorted_dist.resize(size_t(Num)*nPivots);
+    for(int t=0;t<Num;++t)
+    {
+        int i=buf[t].second;
+        table.sorted[t]=i;
+        table.rank[i]=t;
+        table.key[t]=buf[t].first;
+        memcpy(&table.sorted_dist[size_t(t)*nPivots],&table.dist[size_t(i)*nPivots],
+               sizeof(double)*nPivots);
+    }
+}
+
+//lower bound of the distance between two samples with the distances
+//a and b from them to the pivots,it stops as soon as bound is exceeded
+double pivotLowerBound(const double* a,const double* b,int nPivots,double bound)
+{
+    double res=0.0,diff;
+    for(int p=0;p<nPivots;++p)
+    {
+        diff=fabs(a[p]-b[p]);
+        if(diff>res)
+        {
+            res=diff;
+            if(res>bound) break;
+        }
+    }
+    return res;
+}
+
+//print the number of distances read by a stage,the number of pairs
+//pruned by the bounds from the pivots and the time it takes.
+//Pairs skipped for other reasons are neither read nor pruned
+void reportPruning(const char* stage,long long nRead,long long nPivotPruned,
+                   long long nPairs,double elapsed)
+{
+    cout<<stage<<": read "<<nRead<<" of "<<nPairs<<" pairs,"
+        <<nPivotPruned<<" pruned by pivots";
+    if(nPairs>0)
+        cout<<" ("<<100.0*nPivotPruned/nPairs<<"%)";
+    cout<<" in "<<elapsed<<" seconds"<<endl;
+}
+
 //get the minimum distance delta_i=min(d_ij)
-//where the density of j-th sample is greater than that of the i-th one
+//where the density of j-th sample is greater than that of the i-th one.
+//The delta of the densest sample is maxDist,the largest distance between two samples.
+//If pivots is not NULL,the denser samples are kept in buckets by their distance to the
+//first pivot,and only the buckets whose lower bound |d(i,p)-d(j,p)| does not exceed the
+//current minimum are visited from the nearest one outwards.A sample in a visited bucket
+//is read from the matrix only if its bound from all the pivots does not exceed the minimum.
+//For the same distance the densest sample is taken,as the full scan does.
+//For cosine similarity the least similar sample is taken,i.e. the one with the
+//largest angle a(i,j),which is the nearest one to the opposite vector -i by the angle
+//pi-a(i,j),so the same search runs from -i with the angles pi-a(i,p) to the pivots.
+//When the bounds are too loose to prune,e.g. for high-dimensional samples,
+//the remaining samples fall back to the full scan which is cheaper then.
 void getDelta(double** matrix,int Num,const double* rho,double* delta,
-              int* neighbor,int* order)
+              int* neighbor,int* order,double maxDist,const PivotTable* pivots)
 {
     sortByDensity(rho,Num,order);
-    double globalMax=getMatrixData(matrix,0,0);
-    for(int i=0;i<Num;++i)
+    struct timeval start,end;
+    gettimeofday(&start,NULL);
+    long long nVisited=0,nRead=0,nPivotPruned=0;
+    int i=0;
+    if(pivots&&pivots->nPivots>0)
     {
-        double min=getMatrixData(matrix,order[i],order[0]);
-        double buf=0;
-        *(neighbor+order[i])=order[0];
-        for(int j=0;j<i;++j)
+        int nPivots=pivots->nPivots;
+        bool angular=pivots->angular;
+        const double pi=acos(-1.0);
+        const vector<double>& key=pivots->key;
+        const int bucketSize=32;
+        int nBuckets=(Num+bucketSize-1)/bucketSize;
+        //bucket b covers the samples sorted by the distance to the first pivot at
+        //[b*bucketSize,(b+1)*bucketSize),the denser samples inserted so far are stored
+        //at the same entries with their position in order and distances to the pivots
+        vector<int> count(nBuckets,0);
+        vector<int> entry(Num);
+        vector<double> entry_dist(size_t(Num)*nPivots);
+        vector<double> query(nPivots);//distances from the sample,or its opposite,to the pivots
+
+        for(;i<Num;++i)
         {
-            buf=getMatrixData(matrix,order[i],order[j]);
-            if(buf>globalMax) globalMax=buf;
-            if(buf<min)
+            //the cost of a visit is about a quarter of a random read from the matrix
+            if(i>=PIVOT_CHECK&&i%PIVOT_CHECK==0&&
+               nRead+nVisited/4>PIVOT_MAX_WORK*((long long)i*(i-1)/2))
+            {
+                cout<<"delta: pivots are too loose,full scan from sample "<<i<<endl;
+                break;
+            }
+            int s=order[i];
+            const double* ds=&pivots->dist[size_t(s)*nPivots];
+            for(int p=0;p<nPivots;++p)
+                query[p]=angular?pi-ds[p]:ds[p];
+            double min=getMatrixData(matrix,s,order[0]);
+            int pos=0;//position of the nearest denser sample in order
+            double bound=pivotDistance(angular?-min:min,angular)+pivots->tolerance;
+            long long nReadBefore=nRead;
+            //start from the bucket where the query falls,the keys of the buckets
+            //before it are smaller and those after it are not
+            int k=std::lower_bound(key.begin(),key.end(),query[0])-key.begin();
+            k=std::min(k,Num-1)/bucketSize;
+            int lo=k-1,hi=k+1;
+            while(k>=0)
             {
-                min=buf;
-                *(neighbor+order[i])=order[j];
+                for(int t=k*bucketSize;t<k*bucketSize+count[k];++t)
+                {
+                    ++nVisited;
+                    if(pivotLowerBound(&query[0],&entry_dist[size_t(t)*nPivots],
+                                       nPivots,bound)>bound)
+                        continue;
+                    ++nRead;
+                    double buf=getMatrixData(matrix,s,order[entry[t]]);
+                    if(buf<min||(buf==min&&entry[t]<pos))
+                    {
+                        min=buf;
+                        pos=entry[t];
+                        bound=pivotDistance(angular?-min:min,angular)+pivots->tolerance;
+                    }
+                }
+                //the next bucket nearest to the query,unless it is too far
+                double gapLo=lo>=0?query[0]-key[(lo+1)*bucketSize-1]:HUGE_VAL;
+                double gapHi=hi<nBuckets?key[hi*bucketSize]-query[0]:HUGE_VAL;
+                k=-1;
+                if(gapLo<=gapHi&&gapLo<=bound)
+                    k=lo--;
+                else if(gapHi<gapLo&&gapHi<=bound)
+                    k=hi++;
             }
+            *(neighbor+s)=order[pos];
+            *(delta+s)=min;
+            nPivotPruned+=i-(nRead-nReadBefore);//the pairs in the buckets left out too
+
+            //insert the sample into its bucket for the less dense samples
+            int b=pivots->rank[s]/bucketSize;
+            int t=b*bucketSize+count[b]++;
+            entry[t]=i;
+            memcpy(&entry_dist[size_t(t)*nPivots],ds,sizeof(double)*nPivots);
         }
-        *(delta+order[i])=min;
     }
-    *(delta+order[0])=globalMax;
+    if(i<Num)//full scan of the samples from position i in order
+    {
+        //the matrix is streamed row by row instead of reading the pairs of each
+        //sample at random,and each pair updates its less dense sample if that one
+        //is scanned.The nearest denser sample is the one with the smallest
+        //distance and then the smallest position in order,as the loop by samples takes
+        vector<int> pos(Num);//position of each sample in order
+        for(int t=0;t<Num;++t)
+            pos[order[t]]=t;
+        vector<int> nearest(Num,0);//position of the nearest denser sample
+        for(int t=i;t<Num;++t)
+            *(delta+order[t])=getMatrixData(matrix,order[t],order[0]);
+        for(int r=0;r<Num-1;++r)
+        {
+            const double* row=*(matrix+r);
+            int pr=pos[r];
+            for(int j=r+1;j<Num;++j)
+            {
+                double buf=*(row+j-r);
+                int pj=pos[j];
+                if(pr<pj)
+                {
+                    if(pj>=i&&(buf<*(delta+j)||(buf==*(delta+j)&&pr<nearest[j])))
+                    {
+                        *(delta+j)=buf;
+                        nearest[j]=pr;
+                    }
+                }
+                else if(pr>=i&&(buf<*(delta+r)||(buf==*(delta+r)&&pj<nearest[r])))
+                {
+                    *(delta+r)=buf;
+                    nearest[r]=pj;
+                }
+            }
+        }
+        for(int t=i;t<Num;++t)
+            *(neighbor+order[t])=order[nearest[order[t]]];
+        nRead+=(long long)Num*(Num-1)/2-(long long)i*(i-1)/2;
+    }
+    *(delta+order[0])=maxDist;
+    gettimeofday(&end,NULL);
+    reportPruning("delta",nRead,nPivotPruned,(long long)Num*(Num-1)/2,
+                  (end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6);
 }
 
-//find the number of clusters automaticlly in the view of
-//Anomaly Detection with Gaussian distribution
-int numberOfClusters(const double* pgamma,int Num,double threshold)
+//whether candidate a ranks higher than candidate b,
+//larger gamma first and smaller index first for the same gamma
+bool candidateGreater(const Candidate& a,const Candidate& b)
 {
-	double* buf=new double[Num]();
-	memcpy(buf,pgamma,Num*sizeof(double));
-    //sort gamma for each point in ascending order with algorithm in STL
-    std::sort(buf,buf+Num);
-
-	double sum=0.0;
-	for(int i=0;i<Num;++i)
-		sum+=buf[i];
-	double mu=sum/Num;//average of Gaussian distribution
-	sum=0.0;
-	for(int i=0;i<Num;++i)
-		sum+=(buf[i]-mu)*(buf[i]-mu);
-	double variance=sum/Num;//variance of Gaussian distribution
-	double std=sqrt(variance);
+	return a.first>b.first||(a.first==b.first&&a.second<b.second);
+}
 
-    double prob=0;
-	int nClusters=1;
+//find the number of clusters automaticlly in the view of
+//Anomaly Detection with Gaussian distribution,
+//the candidates are sorted by gamma in descending order
+int numberOfClusters(const vector<Candidate>& cand,double mu,double std,double threshold)
+{
+	if(std<=0.0)
+		return 1;//all the samples are alike
+	double prob=0;
+	int nClusters=cand.size();//all the candidates are abnormal
 	double var;
-	for(int i=Num-1;i>=0;--i)
+	for(size_t i=0;i<cand.size();++i)
 	{
-		var=(buf[i]-mu)/std;
-        prob=CDFofNormalDistribution(var);
-        if(i>Num-100) cout<<" "<<prob;
-        if(prob<threshold||(1-prob)<threshold)//abnormal datapoint
+		var=(cand[i].first-mu)/std;
+		prob=CDFofNormalDistribution(var);
+		if(prob<threshold||(1-prob)<threshold)//abnormal datapoint
 			continue;
-		nClusters=Num-1-i;
+		nClusters=i;
 		break;
 	}
-	delete[] buf;
+	return nClusters>0?nClusters:1;
+}
+
+//find the number of clusters at the largest gap between the gamma of
+//consecutive candidates sorted in descending order.
+//The gap after the densest sample is skipped,since its delta is set to
+//the largest distance and it is always a cluster center
+int largestGapClusters(const vector<Candidate>& cand)
+{
+	int nClusters=1;
+	double gap=0.0;
+	for(size_t i=2;i<cand.size();++i)
+		if(cand[i-1].first-cand[i].first>gap)
+		{
+			gap=cand[i-1].first-cand[i].first;
+			nClusters=i;
+		}
+	return nClusters;
+}
+
+//find the number of clusters at the knee of the gamma curve of the candidates
+//sorted in descending order,i.e. the candidate farthest below the chord
+//between the first and the last candidate
+int kneeClusters(const vector<Candidate>& cand)
+{
+	int K=cand.size();
+	if(K<3)
+		return 1;
+	double first=cand[0].first,last=cand[K-1].first;
+	int nClusters=1;
+	double max=0.0,dist;
+	for(int i=1;i<K-1;++i)
+	{
+		dist=first+(last-first)*i/(K-1)-cand[i].first;
+		if(dist>max)
+		{
+			max=dist;
+			nClusters=i;
+		}
+	}
 	return nClusters;
 }
 
 //find initial nClus cluster centers
+//gamma is streamed through a min-heap keeping the candidates with the largest gamma,
+//so the cost is O(N*log(K)) with K=nClus,or K=MAX_CANDIDATES when the number
+//of clusters is estimated by the given detector
 int findInitialCenters(const double* rho,const double* delta,
-                       int Num,int nClus,vector<int>& vec)
+                       int Num,int nClus,int detector,vector<int>& vec)
 {
 	if(NULL==rho||NULL==delta) 
 		return -1;
@@ -412,53 +1066,170 @@ int findInitialCenters(const double* rho,const double* delta,
 	}
 	double delta_range=delta_max-delta_min;
 	
-	double *pgamma=new double[Num];
+	size_t K=nClus>0?nClus:MAX_CANDIDATES;
+	if(K>size_t(Num)) K=Num;
+	vector<Candidate> cand;
+	cand.reserve(K+1);
+	double mu=0.0,m2=0.0,gamma,diff;//Welford's mean and sum of squared deviations
 	for(int t=0;t<Num;++t)
-		*(pgamma+t)=(*(rho+t)-rho_min)*(*(delta+t)-delta_min)/(rho_range*delta_range);
+	{
+		gamma=(*(rho+t)-rho_min)*(*(delta+t)-delta_min)/(rho_range*delta_range);
+		diff=gamma-mu;
+		mu+=diff/(t+1);
+		m2+=diff*(gamma-mu);
+		Candidate c(gamma,t);
+		if(cand.size()<K)
+		{
+			cand.push_back(c);
+			push_heap(cand.begin(),cand.end(),candidateGreater);
+		}
+		else if(K>0&&candidateGreater(c,cand.front()))
+		{
+			pop_heap(cand.begin(),cand.end(),candidateGreater);
+			cand.back()=c;
+			push_heap(cand.begin(),cand.end(),candidateGreater);
+		}
+	}
+	sort_heap(cand.begin(),cand.end(),candidateGreater);
 	
 	if(nClus<=0)//found clusters automatically
 	{
-        double thres=5e-2;
-        nClus=numberOfClusters(pgamma,Num,thres);
+		switch(detector)
+		{
+		case 1://largest gap
+			nClus=largestGapClusters(cand);
+			break;
+		case 2://knee of gamma curve
+			nClus=kneeClusters(cand);
+			break;
+		default://anomaly detection
+			double thres=5e-2;
+			nClus=numberOfClusters(cand,mu,Num>0?sqrt(m2/Num):0.0,thres);
+			if(size_t(nClus)==K&&K<size_t(Num))
+				cerr<<"All the "<<K<<" candidates are abnormal,"
+				    <<"the number of clusters is truncated"<<endl;
+		}
 		cout<<"Number of clusters found "<<nClus<<endl;
 	}
-	for(int s=0;s<nClus;++s)
-	{
-		int max=s;
-		for(int j=s+1;j<Num;++j)
-			if(*(pgamma+max)<*(pgamma+j)) max=j;
-        std::swap(*(pgamma+s),*(pgamma+max));
-		vec.push_back(max);
-	}
-	delete[] pgamma;
-	return nClus;
+	for(int s=0;s<nClus&&s<int(cand.size());++s)
+		vec.push_back(cand[s].second);
+	return vec.size();
 }
 
 //separate halos from cores of each cluster
+//the density on the boundary of each cluster is stored in boundary_rho.
+//Pairs in the same cluster and pairs that cannot raise the boundary density
+//are skipped before reading their distance.If pivots is not NULL,only the pairs
+//whose distances to the first pivot differ by at most radius are visited,
+//walking the samples sorted by that distance,and the pairs farther than radius
+//by the bound from all the pivots are skipped too.
+//For cosine similarity a pair is within radius if its similarity s does not exceed
+//radius,i.e. the angle pi-acos(s) from -i to j does not exceed pi-acos(radius),
+//so the pairs are bounded by the angles pi-a(i,p) from -i to the pivots
 void filterHalos(double** matrix,int Num,int nClus,const int* clus,
-                 const double* rho,double radius,int* halo)
+                 const double* rho,double radius,int* halo,double* boundary_rho,
+                 const PivotTable* pivots)
 {
     memset(halo,0,sizeof(int)*Num);//initialize halo
+    memset(boundary_rho,0,sizeof(double)*nClus);
     if(nClus<=1)
         return;//no need to find halos for a single cluster
 
-    double* boundary_rho=new double[nClus]();//density on the boundary for each cluster
+    struct timeval start,end;
+    gettimeofday(&start,NULL);
     double dist;
     double avg_rho;
+    int nPivots=pivots?pivots->nPivots:0;
+    bool angular=nPivots>0&&pivots->angular;
+    const double pi=acos(-1.0);
+    double bound=0.0;
+    if(nPivots>0)
+        bound=pivotDistance(angular?-radius:radius,angular)+pivots->tolerance;
+    long long nVisited=0,nRead=0,nPivotPruned=0;
+    long long nPairs=(long long)Num*(Num-1)/2;
+    vector<double> first;//distance from each sample,or its opposite,to the first pivot
+    if(nPivots>0)
+    {
+        first.resize(Num);
+        for(int a=0;a<Num;++a)
+            first[a]=angular?pi-pivots->key[a]:pivots->key[a];
+        //count the pairs within the range of the first pivot,
+        //the contiguous scan of all pairs is cheaper when they are too many
+        const vector<double>& key=pivots->key;
+        long long nRange=0;
+        for(int a=0;a<Num;++a)
+        {
+            int lo=std::lower_bound(key.begin(),key.end(),first[a]-bound)-key.begin();
+            int hi=std::upper_bound(key.begin(),key.end(),first[a]+bound)-key.begin();
+            if(lo<a+1) lo=a+1;
+            if(hi>lo) nRange+=hi-lo;
+        }
+        if(nRange>PIVOT_MAX_RANGE*nPairs)
+        {
+            cout<<"halo: pivots are too loose,full scan"<<endl;
+            nPivots=0;
+        }
+    }
+    //cluster and density in the order of the walk,so that they are read contiguously
+    vector<int> walk_clus(Num);
+    vector<double> walk_rho(Num);
+    for(int a=0;a<Num;++a)
+    {
+        int i=nPivots>0?pivots->sorted[a]:a;
+        walk_clus[a]=*(clus+i);
+        walk_rho[a]=*(rho+i);
+    }
     //calculate the density for the boundary of each cluster
-    for(int i=0;i<Num-1;++i)
-        for(int j=i+1;j<Num;++j)
+    vector<double> query(nPivots);//distances from the sample,or its opposite,to the pivots
+    for(int a=0;a<Num-1;++a)
+    {
+        int i=nPivots>0?pivots->sorted[a]:a;
+        int ci=walk_clus[a];
+        int b=a+1;
+        if(nPivots>0)
+        {
+            const double* di=&pivots->sorted_dist[size_t(a)*nPivots];
+            for(int p=0;p<nPivots;++p)
+                query[p]=angular?pi-di[p]:di[p];
+            //skip the samples too near to the first pivot
+            int lo=std::lower_bound(pivots->key.begin(),pivots->key.end(),
+                                    first[a]-bound)-pivots->key.begin();
+            if(b<lo) b=lo;
+        }
+        for(;b<Num;++b)
         {
+            if(nPivots>0&&pivots->key[b]-first[a]>bound)
+                break;//the rest are even farther from the first pivot
+            ++nVisited;
+            int cj=walk_clus[b];
+            if(ci==cj)
+                continue;
+            avg_rho=(walk_rho[a]+walk_rho[b])/2.0;
+            if(boundary_rho[ci]>=avg_rho&&boundary_rho[cj]>=avg_rho)
+                continue;
+            if(nPivots>0&&pivotLowerBound(&query[0],&pivots->sorted_dist[size_t(b)*nPivots],
+                                          nPivots,bound)>bound)
+            {
+                ++nPivotPruned;
+                continue;
+            }
+            int j=nPivots>0?pivots->sorted[b]:b;
+            ++nRead;
             dist=getMatrixData(matrix,i,j);//distance between i and j
-            if(dist<=radius&&*(clus+i)!=*(clus+j))
+            if(dist<=radius)
             {
-                avg_rho=(*(rho+i)+*(rho+j))/2.0;
-                if(boundary_rho[*(clus+i)]<avg_rho)
-                    boundary_rho[*(clus+i)]=avg_rho;
-                if(boundary_rho[*(clus+j)]<avg_rho)
-                    boundary_rho[*(clus+j)]=avg_rho;
+                if(boundary_rho[ci]<avg_rho)
+                    boundary_rho[ci]=avg_rho;
+                if(boundary_rho[cj]<avg_rho)
+                    boundary_rho[cj]=avg_rho;
             }
         }
+    }
+    if(nPivots>0)
+        nPivotPruned+=nPairs-nVisited;//the pairs out of the range of the first pivot
+    gettimeofday(&end,NULL);
+    reportPruning("halo",nRead,nPivotPruned,nPairs,
+                  (end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6);
 
     //find the halos for each cluster
     for(int i=0;i<Num;++i)
@@ -467,7 +1238,6 @@ void filterHalos(double** matrix,int Num,int nClus,const int* clus,
         if(*(rho+i)<boundary_rho[*(clus+i)])
             *(halo+i)=1;
     }
-    delete[] boundary_rho;
 }
 
 //assigen cluster centers to samples
@@ -483,37 +1253,97 @@ void assignClusters(const int* order,const int* neighbor,
 			*(res+*(order+t))=*(res+*(neighbor+*(order+t)));
 }
 
-//algorithm of clustering
-//number of nearest neighbors
-void clustering(const vector<vector<double> >& vec,int nClus,int mode,\
-                int nn,double tau,int metric,const string& outputfile,int* clus)
+//load the distance matrix from the cache in cachedir,
+//or calculate it and save it into the cache unless cachedir is empty
+void loadDistanceMatrix(const vector<vector<double> >& vec,int metric,
+                        const string& cachedir,DistanceMatrix& dm)
 {
 	int Num=vec.size();
-	double** matrix=new double*[Num];
-	for(int i=0;i<Num;++i)
-		*(matrix+i)=new double[Num-i]();
-	cout<<"generating distance matrix...\n";
-	//calculate the two-dimensional distance matrix
-    double(*metricfun)(const vector<double>&,const vector<double>&);
-    if(metric==0)//Euclidean
-        metricfun=EuclideanDistance;
-    else//Cosine
-        metricfun=cosineDistance;
-    distanceMatrix(vec,matrix,metricfun);
-	
-	cout<<"computing density for each sample...\n";
-	double* rho=new double[Num];
+	dm.Num=Num;
+	dm.rows=new double*[Num];
+	dm.base=NULL;
+	dm.mapped=NULL;
+	dm.mapped_len=0;
+	dm.maxDist=0.0;
+	dm.pivots.nPivots=0;
+	string cachefile;
+	if(cachedir!="")
+	{
+		cachefile=distanceCacheName(cachedir,vec,metric);
+		dm.mapped=mapDistanceCache(cachefile,Num,metric,dm.mapped_len);
+	}
+	if(dm.mapped)
+	{
+		cout<<"loading distance matrix from "<<cachefile<<"...\n";
+		dm.base=(double*)((char*)dm.mapped+sizeof(DistanceCacheHeader));
+		matrixRows(dm.base,Num,dm.rows);
+		dm.maxDist=((const DistanceCacheHeader*)dm.mapped)->max_dist;
+	}
+	else
+	{
+		dm.base=new double[matrixSize(Num)]();
+		matrixRows(dm.base,Num,dm.rows);
+		cout<<"generating distance matrix...\n";
+		//calculate the two-dimensional distance matrix
+		double(*metricfun)(const vector<double>&,const vector<double>&);
+		if(metric==0)//Euclidean
+			metricfun=EuclideanDistance;
+		else//Cosine
+			metricfun=cosineDistance;
+		dm.maxDist=distanceMatrix(vec,dm.rows,metricfun);
+		if(cachedir!="")
+		{
+			if(saveDistanceCache(cachefile,dm.base,Num,metric,dm.maxDist))
+				cout<<"distance matrix cached in "<<cachefile<<endl;
+			else
+				cerr<<"Failed to cache distance matrix in "<<cachefile<<endl;
+		}
+	}
+	selectPivots(dm.rows,Num,NUM_PIVOTS,metric,dm.maxDist,dm.pivots);
+}
+
+//free the memory or the mapping of the distance matrix
+void freeDistanceMatrix(DistanceMatrix& dm)
+{
+	if(dm.mapped)
+		munmap(dm.mapped,dm.mapped_len);
+	else
+		delete[] dm.base;
+	delete[] dm.rows;
+	dm.rows=NULL;
+	dm.base=NULL;
+	dm.mapped=NULL;
+}
+
+//clustering on a distance matrix with the buffers in ws
+//the distance matrix and its pivots are only read,
+//so they can be shared between concurrent calls
+int clusterMatrix(const vector<vector<double> >& vec,const DistanceMatrix& dm,int nClus,
+                  int detector,int mode,int nn,double tau,int metric,
+                  const string& outputfile,Workspace& ws,int* clus)
+{
+	int Num=vec.size();
+	double** matrix=dm.rows;
+	const PivotTable* pivots=dm.pivots.nPivots>0?&dm.pivots:NULL;
+	ws.rho.resize(Num);
+	ws.delta.resize(Num);
+	ws.neighbor.resize(Num);
+	ws.order.resize(Num);
+	ws.halo.resize(Num);
+	double* rho=&ws.rho[0];
+	double* delta=&ws.delta[0];
+	int* neighbor=&ws.neighbor[0];
+	int* order=&ws.order[0];
+	int* halo=&ws.halo[0];
 
+	cout<<"computing density for each sample...\n";
     double radius=searchRadius(matrix,Num,tau);
     cout<<"Radius searched automatically:"<<radius<<endl;
     density(matrix,Num,radius,mode,nn,rho);
 	
 	cout<<"computing delta for each sample...\n";
 	//get delta
-	double* delta=new double[Num];
-	int* neighbor=new int[Num];
-	int* order=new int[Num];
-	getDelta(matrix,Num,rho,delta,neighbor,order);
+	getDelta(matrix,Num,rho,delta,neighbor,order,dm.maxDist,pivots);
 
 	//save rho and delty into file
     string decisiongraph_file=outputfile+".decisiongraph";
@@ -525,7 +1355,7 @@ void clustering(const vector<vector<double> >& vec,int nClus,int mode,\
 	cout<<"finding initial cluster centers...\n";
 	vector<int> clustersVec;
 	//find initial nClus cluster centers
-	findInitialCenters(rho,delta,Num,nClus,clustersVec);
+	nClus=findInitialCenters(rho,delta,Num,nClus,detector,clustersVec);
     //save the index of samples treated as cluster centers into file
     string centers_file=outputfile+".centers";
     ofstream centers_out(centers_file.c_str());
@@ -538,16 +1368,12 @@ void clustering(const vector<vector<double> >& vec,int nClus,int mode,\
     assignClusters(order,neighbor,Num,clustersVec,clus);
 
     cout<<"filtering halos from cores of each cluster...\n";
-    int* halo=new int[Num];
-    filterHalos(matrix,Num,nClus,clus,rho,radius,halo);
-	//free memory
-	for(int ii=0;ii<Num;++ii)
-		delete[] *(matrix+ii);
-	delete[] matrix;
-	delete[] rho;
-	delete[] delta;
-	delete[] neighbor;
-	delete[] order;
+    ws.boundary_rho.resize(nClus>0?nClus:1);
+    filterHalos(matrix,Num,nClus,clus,rho,radius,halo,&ws.boundary_rho[0],pivots);
+
+    //save the model used to assign new samples in prediction mode
+    string model_file=outputfile+".model";
+    saveModel(vec,rho,clus,halo,&ws.boundary_rho[0],nClus,radius,metric,mode,nn,model_file);
 
     //save the results of clustering into file
     string clust_file=outputfile+".result";
@@ -555,8 +1381,633 @@ void clustering(const vector<vector<double> >& vec,int nClus,int mode,\
     for(int i=0;i<Num;++i)
         clus_out<<i<<' '<<*(clus+i)<<' '<<*(halo+i)<<endl;
     clus_out.close();
+    return nClus;
+}
+
+//algorithm of clustering
+//number of nearest neighbors
+//the distance matrix is cached in cachedir unless it is empty
+void clustering(const vector<vector<double> >& vec,int nClus,int detector,\
+                int mode,int nn,double tau,int metric,const string& outputfile,\
+                const string& cachedir,int* clus)
+{
+	DistanceMatrix dm;
+	loadDistanceMatrix(vec,metric,cachedir,dm);
+	Workspace ws;
+	clusterMatrix(vec,dm,nClus,detector,mode,nn,tau,metric,outputfile,ws,clus);
+	freeDistanceMatrix(dm);
+}
 
-    delete[] halo;
+//save the reference samples and their clustering into a model file
+//the first line stores Num Dim metric mode nn nClus radius,
+//the second line the density on the boundary of each cluster,
+//and each of the following lines stores the features,rho,cluster and halo of a sample
+void saveModel(const vector<vector<double> >& vec,const double* rho,const int* clus,
+               const int* halo,const double* boundary_rho,int nClus,double radius,
+               int metric,int mode,int nn,const string& modelfile)
+{
+    int Num=vec.size();
+    int Dim=Num>0?vec[0].size():0;
+    ofstream ofs(modelfile.c_str());
+    ofs<<std::setprecision(17);
+    ofs<<Num<<' '<<Dim<<' '<<metric<<' '<<mode<<' '<<nn<<' '<<nClus<<' '<<radius<<endl;
+    for(int c=0;c<nClus;++c)
+        ofs<<boundary_rho[c]<<' ';
+    ofs<<endl;
+    for(int i=0;i<Num;++i)
+    {
+        for(int d=0;d<Dim;++d)
+            ofs<<vec[i][d]<<' ';
+        ofs<<*(rho+i)<<' '<<*(clus+i)<<' '<<*(halo+i)<<endl;
+    }
+    ofs.close();
+}
+
+//load the model saved by saveModel
+bool loadModel(const char* modelfile,Model& model)
+{
+    ifstream ifs(modelfile);
+    if(!ifs)
+    {
+        cerr<<modelfile<<" doesn't exist!\n";
+        return false;
+    }
+    ifs>>model.Num>>model.Dim>>model.metric>>model.mode>>model.nn
+       >>model.nClus>>model.radius;
+    if(!ifs||model.Num<0||model.Dim<=0||model.nClus<0||model.nClus>model.Num)
+    {
+        cerr<<modelfile<<" is not a valid model!\n";
+        return false;
+    }
+    model.boundary_rho.assign(model.nClus,0.0);
+    for(int c=0;c<model.nClus;++c)
+        ifs>>model.boundary_rho[c];
+    model.data.assign(model.Num,vector<double>(model.Dim,0.0));
+    model.rho.assign(model.Num,0.0);
+    model.clus.assign(model.Num,-1);
+    model.halo.assign(model.Num,0);
+    for(int i=0;i<model.Num;++i)
+    {
+        for(int d=0;d<model.Dim;++d)
+            ifs>>model.data[i][d];
+        ifs>>model.rho[i]>>model.clus[i]>>model.halo[i];
+        if(model.clus[i]<-1||model.clus[i]>=model.nClus)
+        {
+            cerr<<modelfile<<" is not a valid model!\n";
+            return false;
+        }
+    }
+    if(!ifs)
+    {
+        cerr<<modelfile<<" is not a valid model!\n";
+        return false;
+    }
+    return true;
+}
+
+//build a node of the kd-tree from the samples in index[lo,hi)
+//and return the position of the node
+int buildKDNode(const vector<vector<double> >& vec,const double* rho,
+                KDTree& tree,int lo,int hi)
+{
+    const int leafSize=16;
+    int Dim=tree.Dim;
+    int node=tree.lo.size();
+    tree.lo.push_back(lo);
+    tree.hi.push_back(hi);
+    tree.left.push_back(-1);
+    tree.right.push_back(-1);
+    tree.max_rho.push_back(*(rho+tree.index[lo]));
+    tree.box.insert(tree.box.end(),vec[tree.index[lo]].begin(),vec[tree.index[lo]].end());
+    tree.box.insert(tree.box.end(),vec[tree.index[lo]].begin(),vec[tree.index[lo]].end());
+    double* box=&tree.box[2*Dim*node];
+    for(int i=lo+1;i<hi;++i)
+    {
+        const vector<double>& pt=vec[tree.index[i]];
+        for(int d=0;d<Dim;++d)
+        {
+            if(pt[d]<box[d]) box[d]=pt[d];
+            if(pt[d]>box[Dim+d]) box[Dim+d]=pt[d];
+        }
+        if(*(rho+tree.index[i])>tree.max_rho[node])
+            tree.max_rho[node]=*(rho+tree.index[i]);
+    }
+    if(hi-lo<=leafSize)
+        return node;
+
+    //split along the dimension with the largest spread
+    int axis=0;
+    for(int d=1;d<Dim;++d)
+        if(box[Dim+d]-box[d]>box[Dim+axis]-box[axis]) axis=d;
+    if(box[Dim+axis]-box[axis]<=0)
+        return node;//all the samples are identical
+    int mid=(lo+hi)/2;
+    //partial sort of index[lo,hi) by the coordinate on the axis
+    vector<std::pair<double,int> > buf(hi-lo);
+    for(int i=lo;i<hi;++i)
+        buf[i-lo]=std::make_pair(vec[tree.index[i]][axis],tree.index[i]);
+    nth_element(buf.begin(),buf.begin()+(mid-lo),buf.end());
+    for(int i=lo;i<hi;++i)
+        tree.index[i]=buf[i-lo].second;
+
+    int left=buildKDNode(vec,rho,tree,lo,mid);
+    int right=buildKDNode(vec,rho,tree,mid,hi);
+    tree.left[node]=left;
+    tree.right[node]=right;
+    return node;
+}
+
+//build the kd-tree over the reference samples
+void buildKDTree(const vector<vector<double> >& vec,const double* rho,KDTree& tree)
+{
+    int Num=vec.size();
+    tree.Dim=Num>0?vec[0].size():0;
+    tree.index.resize(Num);
+    for(int i=0;i<Num;++i)
+        tree.index[i]=i;
+    tree.lo.clear();
+    tree.hi.clear();
+    tree.left.clear();
+    tree.right.clear();
+    tree.max_rho.clear();
+    tree.box.clear();
+    if(Num>0)
+        buildKDNode(vec,rho,tree,0,Num);
+}
+
+//minimum Euclidean distance between a sample and the bounding box of a node
+double boxDistance(const KDTree& tree,int node,const vector<double>& pt)
+{
+    int Dim=tree.Dim;
+    const double* box=&tree.box[2*Dim*node];
+    double res=0.0,diff;
+    for(int d=0;d<Dim;++d)
+    {
+        if(pt[d]<box[d]) diff=box[d]-pt[d];
+        else if(pt[d]>box[Dim+d]) diff=pt[d]-box[Dim+d];
+        else continue;
+        res+=diff*diff;
+    }
+    return sqrt(res);
+}
+
+//accumulate the kernel density of a sample from the reference samples within cutoff
+void kdDensity(const KDTree& tree,const vector<vector<double> >& ref,int node,
+               const vector<double>& pt,double cutoff,double radius,int mode,double& rho)
+{
+    if(boxDistance(tree,node,pt)>cutoff)
+        return;
+    if(tree.left[node]>=0)
+    {
+        kdDensity(tree,ref,tree.left[node],pt,cutoff,radius,mode,rho);
+        kdDensity(tree,ref,tree.right[node],pt,cutoff,radius,mode,rho);
+        return;
+    }
+    double dist;
+    for(int i=tree.lo[node];i<tree.hi[node];++i)
+    {
+        dist=EuclideanDistance(pt,ref[tree.index[i]]);
+        if(mode==0)//Gaussian kernel
+            rho+=exp(-(dist/radius)*(dist/radius));
+        else if(dist<radius)//cutoff kernel
+            rho+=1;
+    }
+}
+
+//find the k nearest reference samples,the distances are kept in a max-heap
+void kdNearest(const KDTree& tree,const vector<vector<double> >& ref,int node,
+               const vector<double>& pt,size_t k,vector<double>& heap)
+{
+    if(heap.size()==k&&boxDistance(tree,node,pt)>=heap.front())
+        return;
+    if(tree.left[node]>=0)
+    {
+        int first=tree.left[node],second=tree.right[node];
+        if(boxDistance(tree,second,pt)<boxDistance(tree,first,pt))
+            std::swap(first,second);
+        kdNearest(tree,ref,first,pt,k,heap);
+        kdNearest(tree,ref,second,pt,k,heap);
+        return;
+    }
+    double dist;
+    for(int i=tree.lo[node];i<tree.hi[node];++i)
+    {
+        dist=EuclideanDistance(pt,ref[tree.index[i]]);
+        if(heap.size()<k)
+        {
+            heap.push_back(dist);
+            push_heap(heap.begin(),heap.end());
+        }
+        else if(dist<heap.front())
+        {
+            pop_heap(heap.begin(),heap.end());
+            heap.back()=dist;
+            push_heap(heap.begin(),heap.end());
+        }
+    }
+}
+
+//find the nearest reference sample whose density is greater than rho
+//nodes without any denser sample are skipped
+void kdNearestDenser(const KDTree& tree,const vector<vector<double> >& ref,
+                     const vector<double>& ref_rho,int node,const vector<double>& pt,
+                     double rho,double& min,int& neighbor)
+{
+    if(tree.max_rho[node]<=rho||boxDistance(tree,node,pt)>=min)
+        return;
+    if(tree.left[node]>=0)
+    {
+        int first=tree.left[node],second=tree.right[node];
+        if(boxDistance(tree,second,pt)<boxDistance(tree,first,pt))
+            std::swap(first,second);
+        kdNearestDenser(tree,ref,ref_rho,first,pt,rho,min,neighbor);
+        kdNearestDenser(tree,ref,ref_rho,second,pt,rho,min,neighbor);
+        return;
+    }
+    double dist;
+    for(int i=tree.lo[node];i<tree.hi[node];++i)
+    {
+        int t=tree.index[i];
+        if(ref_rho[t]<=rho)
+            continue;
+        dist=EuclideanDistance(pt,ref[t]);
+        if(dist<min)
+        {
+            min=dist;
+            neighbor=t;
+        }
+    }
+}
+
+//assign the i-th new sample to the cluster of its nearest reference sample with higher density
+void predictSample(const PredictContext& ctx,int i)
+{
+    const Model& model=*ctx.model;
+    const KDTree* tree=ctx.tree;
+    const vector<double>& pt=(*ctx.vec)[i];
+    int nRef=model.Num;
+    size_t k=ctx.k;
+    double rho=0.0;
+    double dist;
+    vector<double> heap;
+    heap.reserve(k+1);
+    if(tree&&model.mode!=2)
+        kdDensity(*tree,model.data,0,pt,model.mode==0?6*model.radius:model.radius,
+                  model.radius,model.mode,rho);
+    else if(tree)
+    {
+        if(k>0)
+            kdNearest(*tree,model.data,0,pt,k,heap);
+    }
+    else
+    {
+        for(int j=0;j<nRef;++j)
+        {
+            dist=ctx.metricfun(pt,model.data[j]);
+            if(model.mode==0)
+                rho+=exp(-(dist/model.radius)*(dist/model.radius));
+            else if(model.mode==1)
+            {
+                if(dist<model.radius) rho+=1;
+            }
+            else if(heap.size()<k)
+            {
+                heap.push_back(dist);
+                push_heap(heap.begin(),heap.end());
+            }
+            else if(k>0&&dist<heap.front())
+            {
+                pop_heap(heap.begin(),heap.end());
+                heap.back()=dist;
+                push_heap(heap.begin(),heap.end());
+            }
+        }
+    }
+    if(model.mode==2)
+    {
+        for(size_t t=0;t<heap.size();++t)
+            rho-=heap[t];
+        rho/=model.nn;
+    }
+
+    //nearest reference sample with higher density,
+    //or the nearest one if the new sample is the densest
+    int neighbor=-1;
+    double min=HUGE_VAL;
+    if(tree)
+    {
+        kdNearestDenser(*tree,model.data,model.rho,0,pt,rho,min,neighbor);
+        if(neighbor<0)
+            kdNearestDenser(*tree,model.data,model.rho,0,pt,-HUGE_VAL,min,neighbor);
+    }
+    else
+    {
+        for(int pass=0;pass<2&&neighbor<0;++pass)
+            for(int j=0;j<nRef;++j)
+            {
+                if(pass==0&&model.rho[j]<=rho)
+                    continue;
+                dist=ctx.metricfun(pt,model.data[j]);
+                if(dist<min||neighbor<0)
+                {
+                    min=dist;
+                    neighbor=j;
+                }
+            }
+    }
+    int c=model.clus[neighbor];
+    *(ctx.res+i)=c;
+    *(ctx.halo+i)=(c>=0&&c<model.nClus&&rho<model.boundary_rho[c])?1:0;
+}
+
+//worker thread of prediction mode,new samples are taken in chunks
+void* predictWorker(void* arg)
+{
+    PredictContext* ctx=(PredictContext*)arg;
+    const int chunk=64;
+    int Num=ctx->vec->size();
+    while(true)
+    {
+        int first=__atomic_fetch_add(&ctx->next,chunk,__ATOMIC_RELAXED);
+        if(first>=Num)
+            break;
+        int last=first+chunk<Num?first+chunk:Num;
+        for(int i=first;i<last;++i)
+            predictSample(*ctx,i);
+    }
+    return NULL;
+}
+
+//assign new samples to the clusters of an existing model
+//the density of each new sample is computed against the reference samples as if
+//it were appended to them,and it takes the cluster of its nearest reference sample
+//with higher density,the same as getDelta() and assignClusters() do.
+//A kd-tree is used for Euclidean metric,the Gaussian kernel is truncated
+//at 6*radius where it is below 1e-15.The samples are shared by one worker
+//per processor.
+void predict(const Model& model,const vector<vector<double> >& vec,int* res,int* halo)
+{
+    int Num=vec.size();
+    int nRef=model.Num;
+    if(nRef==0)
+    {
+        for(int i=0;i<Num;++i)
+            *(res+i)=-1,*(halo+i)=0;
+        return;
+    }
+    PredictContext ctx;
+    ctx.model=&model;
+    ctx.vec=&vec;
+    ctx.tree=NULL;
+    if(model.metric==0)//Euclidean
+        ctx.metricfun=EuclideanDistance;
+    else//Cosine
+        ctx.metricfun=cosineDistance;
+    //the new sample itself is one of its nearest neighbors in KNN mode
+    int kk=model.nn-1<nRef?model.nn-1:nRef;
+    ctx.k=kk>0?kk:0;
+    ctx.res=res;
+    ctx.halo=halo;
+    ctx.next=0;
+
+    KDTree tree;
+    if(model.metric==0)
+    {
+        cout<<"building kd-tree over the reference samples...\n";
+        buildKDTree(model.data,&model.rho[0],tree);
+        ctx.tree=&tree;
+    }
+
+    int nWorkers=sysconf(_SC_NPROCESSORS_ONLN);
+    if(nWorkers<=0)
+        nWorkers=1;
+    cout<<"assigning new samples with "<<nWorkers<<" workers...\n";
+    struct timeval start,end;
+    gettimeofday(&start,NULL);
+    vector<pthread_t> workers(nWorkers);
+    for(int i=0;i<nWorkers;++i)
+        pthread_create(&workers[i],NULL,predictWorker,&ctx);
+    for(int i=0;i<nWorkers;++i)
+        pthread_join(workers[i],NULL);
+    gettimeofday(&end,NULL);
+    double elapsed=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6;
+    cout<<"assigned "<<Num<<" samples in "<<elapsed<<" seconds";
+    if(elapsed>0)
+        cout<<" ("<<Num/elapsed<<" samples per second)";
+    cout<<endl;
+}
+
+//parse one line of options into a job of the server mode,
+//the options missing in the line take the values in defaults,
+//Num is the number of loaded samples which bounds tau and nn
+bool parseJob(const string& line,int Num,const Job& defaults,Job& job)
+{
+    job=defaults;
+    stringstream ss;
+    ss<<line;
+    string cmd,val;
+    while(ss>>cmd)
+    {
+        if(!(ss>>val))
+        {
+            job.error="Value missing for option:"+cmd;
+            return false;
+        }
+        if(cmd=="--clusters")
+            job.nClus=atoi(val.c_str());
+        else if(cmd=="--detector")
+            job.detector=atoi(val.c_str());
+        else if(cmd=="--mode")
+            job.mode=atoi(val.c_str());
+        else if(cmd=="--neighbors")
+            job.nn=atoi(val.c_str());
+        else if(cmd=="--tau")
+            job.tau=atof(val.c_str());
+        else if(cmd=="--output")
+        {
+            job.outputfile=val;
+            job.named=true;
+        }
+        else
+        {
+            job.error="Invalid option:"+cmd;
+            return false;
+        }
+    }
+    if(job.mode<0||job.mode>2)
+        job.error="Invalid option for computing density";
+    else if(job.tau<=0.0||job.tau>=1)
+        job.error="Invalid tau(lies in (0,1)";
+    else if(round(job.tau*Num)<1)
+        job.error="Invalid tau(too small for the number of samples)";
+    else if(job.mode==2&&(job.nn<=0||job.nn>Num))
+        job.error="Invalid number of neighbors";
+    return job.error=="";
+}
+
+//append a job to the queue and wake up one worker,only one thread pushes jobs
+void pushJob(JobQueue& queue,const Job& job)
+{
+    size_t pos=__atomic_load_n(&queue.tail,__ATOMIC_RELAXED);
+    JobSlot& slot=queue.slots[pos&queue.mask];
+    while(__atomic_load_n(&slot.seq,__ATOMIC_ACQUIRE)!=pos)//the slot is still read by a worker
+        usleep(100);
+    slot.job=job;
+    __atomic_store_n(&slot.seq,pos+1,__ATOMIC_RELEASE);//publish the job
+    __atomic_store_n(&queue.tail,pos+1,__ATOMIC_RELEASE);
+    sem_post(&queue.jobs);
+}
+
+//take a job from the queue without locking,
+//return false if the queue is empty
+bool popJob(JobQueue& queue,Job& job)
+{
+    size_t pos=__atomic_load_n(&queue.head,__ATOMIC_RELAXED);
+    while(true)
+    {
+        JobSlot& slot=queue.slots[pos&queue.mask];
+        size_t seq=__atomic_load_n(&slot.seq,__ATOMIC_ACQUIRE);
+        if(seq<pos+1)
+            return false;//empty
+        if(seq==pos+1)
+        {
+            //pos is updated to the current head if another worker claimed the slot
+            if(__atomic_compare_exchange_n(&queue.head,&pos,pos+1,false,
+                                           __ATOMIC_RELAXED,__ATOMIC_RELAXED))
+            {
+                job=slot.job;
+                //release the slot to the producer
+                __atomic_store_n(&slot.seq,pos+queue.mask+1,__ATOMIC_RELEASE);
+                return true;
+            }
+        }
+        else
+            pos=__atomic_load_n(&queue.head,__ATOMIC_RELAXED);
+    }
+}
+
+//worker thread of the server mode,every worker owns a workspace
+//which is reused by all the jobs it takes.
+//It sleeps on the semaphore of the queue until a job is pushed,
+//or until the producer is done and wakes up every worker to exit.
+void* serverWorker(void* arg)
+{
+    ServerContext* ctx=(ServerContext*)arg;
+    int Num=ctx->vec->size();
+    Workspace ws;
+    vector<int> clus(Num);
+    Job job;
+    struct timeval start,end;
+    while(true)
+    {
+        while(sem_wait(&ctx->queue->jobs)!=0&&errno==EINTR)
+            continue;
+        if(!popJob(*ctx->queue,job))
+        {
+            //every pushed job holds one count of the semaphore,
+            //so the queue is only found empty after the producer is done
+            if(__atomic_load_n(&ctx->queue->done,__ATOMIC_ACQUIRE))
+                break;
+            continue;
+        }
+        gettimeofday(&start,NULL);
+        int nClus=clusterMatrix(*ctx->vec,*ctx->dm,job.nClus,job.detector,job.mode,
+                                job.nn,job.tau,ctx->metric,job.outputfile,ws,&clus[0]);
+        gettimeofday(&end,NULL);
+        double elapsed=(end.tv_sec-start.tv_sec)+(end.tv_usec-start.tv_usec)*1e-6;
+
+        pthread_mutex_lock(ctx->reply_lock);
+        *ctx->reply<<job.id<<" ok "<<nClus<<' '<<job.outputfile<<' '<<elapsed<<endl;
+        ctx->outputs->erase(job.outputfile);
+        pthread_mutex_unlock(ctx->reply_lock);
+    }
+    return NULL;
+}
+
+//serve clustering requests read from stdin on the loaded samples.
+//Each line holds the options of one request,and a reply
+//"id ok clusters output seconds" or "id error message" is written to stdout
+//when it is done.A request without --output writes to the default output
+//file suffixed with its id,and a request whose output file is still
+//written by an earlier one is rejected.The samples and the distance matrix are shared by
+//all the workers.The replies are written to reply,which main() binds to
+//stdout after redirecting cout to stderr.
+void serve(const vector<vector<double> >& vec,int metric,const string& cachedir,
+           int nWorkers,const Job& defaults,std::ostream& reply)
+{
+    if(nWorkers<=0)
+        nWorkers=sysconf(_SC_NPROCESSORS_ONLN);
+    if(nWorkers<=0)
+        nWorkers=1;
+
+    DistanceMatrix dm;
+    loadDistanceMatrix(vec,metric,cachedir,dm);
+
+    JobQueue queue;
+    const size_t capacity=1024;
+    queue.slots.resize(capacity);
+    for(size_t i=0;i<capacity;++i)
+        queue.slots[i].seq=i;
+    queue.mask=capacity-1;
+    queue.head=0;
+    queue.tail=0;
+    queue.done=0;
+    sem_init(&queue.jobs,0,0);
+
+    pthread_mutex_t reply_lock;
+    pthread_mutex_init(&reply_lock,NULL);
+    set<string> outputs;
+    ServerContext ctx;
+    ctx.vec=&vec;
+    ctx.dm=&dm;
+    ctx.metric=metric;
+    ctx.queue=&queue;
+    ctx.reply=&reply;
+    ctx.reply_lock=&reply_lock;
+    ctx.outputs=&outputs;
+
+    vector<pthread_t> workers(nWorkers);
+    for(int i=0;i<nWorkers;++i)
+        pthread_create(&workers[i],NULL,serverWorker,&ctx);
+    cerr<<"serving with "<<nWorkers<<" workers...\n";
+
+    string line;
+    Job job;
+    long id=0;
+    while(getline(cin,line))
+    {
+        if(line.find_first_not_of(" \t\r")==string::npos)
+            continue;
+        bool ok=parseJob(line,vec.size(),defaults,job);
+        job.id=id;
+        if(ok&&!job.named)
+        {
+            stringstream ss;
+            ss<<defaults.outputfile<<'.'<<id;
+            job.outputfile=ss.str();
+        }
+        pthread_mutex_lock(&reply_lock);
+        if(ok&&!outputs.insert(job.outputfile).second)
+        {
+            job.error="Output file in use:"+job.outputfile;
+            ok=false;
+        }
+        if(!ok)
+            reply<<id<<" error "<<job.error<<endl;
+        pthread_mutex_unlock(&reply_lock);
+        if(ok)
+            pushJob(queue,job);
+        ++id;
+    }
+    __atomic_store_n(&queue.done,1,__ATOMIC_RELEASE);
+    for(int i=0;i<nWorkers;++i)
+        sem_post(&queue.jobs);//wake up every worker to exit
+    for(int i=0;i<nWorkers;++i)
+        pthread_join(workers[i],NULL);
+
+    sem_destroy(&queue.jobs);
+    pthread_mutex_destroy(&reply_lock);
+    freeDistanceMatrix(dm);
 }
 
 //read data from file
@@ -577,7 +2028,7 @@ void readData(const char* filename,int withlabel,
 			ss.clear();
 			ss<<line;
 			while(ss>>val) subvec.push_back(val);
-            if(withlabel>0)//the last column is the corresponding label
+            if(withlabel>0&&!subvec.empty())//the last column is the corresponding label
             {
                 vector<double>::iterator last=subvec.end()-1;
                 label_vec.push_back(*last);
@@ -610,8 +2061,9 @@ void checkCDF()
 }
 
 //process parameters
-void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
-                   int& mode,double& tau,int& metric,int& withlabel,string& outputfile)
+void processParams(const string& line,string& inputfile,int& nClus,int& detector,\
+                   int& nn,int& mode,double& tau,int& metric,int& withlabel,string& outputfile,
+                   string& modelfile,string& cachedir,int& nWorkers)
 {
     if(!line.size())
     {
@@ -621,12 +2073,16 @@ void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
     //set default values for parameters
     inputfile="";
     nClus=-1;
+    detector=0;//anomaly detection
     nn=5;
     mode=0;//Gauss kernel.
     tau=0.05;//average percent for the number of neighbors of each point
     metric=0;//Euclidean
     outputfile="";//output
     withlabel=0;//without label in the input file
+    modelfile="";//clustering instead of prediction
+    cachedir="";//distance matrix is not cached
+    nWorkers=-1;//run once instead of serving requests
 
     map<string,int> cmd_map;
     cmd_map["--help"]=-1;
@@ -638,6 +2094,10 @@ void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
     cmd_map["--output"]=6;
     cmd_map["--withlabel"]=7;
     cmd_map["--tau"]=8;
+    cmd_map["--predict"]=9;
+    cmd_map["--cache"]=10;
+    cmd_map["--detector"]=11;
+    cmd_map["--serve"]=12;
 
     stringstream ss;
     ss<<line;
@@ -689,7 +2149,7 @@ void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
             cout<<"clusters:"<<nClus<<endl;
             break;
         case 3://number of nearest neighbors
-            ss>>nn;
+            nn=atoi(val_vec[sz].c_str());
             cout<<"neighbors:"<<nn<<endl;
             break;
         case 4://metric for distance
@@ -717,6 +2177,23 @@ void processParams(const string& line,string& inputfile,int& nClus,int& nn,\
                 exit(0);
             }
             break;
+        case 9://model used to assign new samples
+            modelfile=val_vec[sz];
+            cout<<"predict:"<<modelfile<<endl;
+            break;
+        case 10://directory of the distance matrix cache
+            cachedir=val_vec[sz];
+            cout<<"cache:"<<cachedir<<endl;
+            break;
+        case 11://approach to estimate the number of clusters
+            detector=atoi(val_vec[sz].c_str());
+            cout<<"detector:"<<detector<<endl;
+            break;
+        case 12://number of workers in server mode
+            nWorkers=atoi(val_vec[sz].c_str());
+            if(nWorkers<0) nWorkers=0;
+            cout<<"serve:"<<nWorkers<<endl;
+            break;
         default:
             cerr<<"Invalid option:"<<cmd<<endl;
             help();
@@ -735,6 +2212,11 @@ OPTIONS\n\
     --clusters  Specify the number of clusters.\n\
                 If clusters<=0, the program will estimate the appropriate\n\
                 number of clusters automatically.\n\
+    --detector  Specify the approach to estimate the number of clusters,\n\
+                which works only when clusters<=0.\n\
+                0-Anomaly Detection with Gaussian distribution(default)\n\
+                1-Largest gap of gamma=rho*delta\n\
+                2-Knee of gamma=rho*delta\n\
     --withlabel Specify whether the last column in the input files are labels.\n\
                 0-the last column is also one of the features.\n\
                 1-the last column indicates the label of each sample.\n\
@@ -756,5 +2238,24 @@ OPTIONS\n\
                 The file named output.result stores the clustering result,\n\
                 in which the first column indicates the index of each sample\n\
                 and the second column indicate the index of its cluster.\n\
+                The file named output.model stores the reference samples with their\n\
+                density,cluster and halo flag,which can be used by '--predict'.\n\
+    --predict   Specify the model file saved by a previous clustering.\n\
+                The samples in the input file are assigned to the clusters of the model\n\
+                instead of being clustered,and the file named output.prediction stores\n\
+                the result in the same format as output.result.\n\
+                Every sample must have as many features as the model,and the\n\
+                samples are assigned by one thread per processor.\n\
+    --cache     Specify the directory in which the distance matrix is cached.\n\
+                The cache is keyed by the features of the samples and the metric,\n\
+                and later runs on the same input map it instead of recomputing it.\n\
+    --serve     Specify the number of workers(0-one per processor) and keep running\n\
+                as a server on the samples in the input file.\n\
+                Each line read from stdin is a request with the options --clusters,\n\
+                --detector,--mode,--neighbors,--tau and --output(default:output.id,\n\
+                where id is the index of the request counted from 0),and the other options\n\
+                are the defaults.The reply \"id ok clusters output seconds\" or\n\
+                \"id error message\" is written to stdout when a request is done.\n\
+                A request whose output is still being written by another one is rejected.\n\
     --help"<<endl;
 }